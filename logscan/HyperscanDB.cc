@@ -9,7 +9,6 @@ namespace logscan
     HyperscanDB::HyperscanDB()
     : db_(nullptr)
     , scratch_(nullptr)
-    , match_id_(-1)
     {
     }
 
@@ -75,6 +74,24 @@ namespace logscan
         }
     }
 
+    size_t HyperscanDB::database_size() const
+    {
+        size_t size = 0;
+        if (db_ != nullptr) {
+            hs_database_size(db_, &size);
+        }
+        return size;
+    }
+
+    size_t HyperscanDB::scratch_size() const
+    {
+        size_t size = 0;
+        if (scratch_ != nullptr) {
+            hs_scratch_size(scratch_, &size);
+        }
+        return size;
+    }
+
     int HyperscanDB::OnMatch(unsigned int id, unsigned long long from, unsigned long long to,
         unsigned int flags, void* context)
     {
@@ -82,21 +99,42 @@ namespace logscan
         (void)to;
         (void)flags;
 
-        static_cast<HyperscanDB*>(context)->match_id_ = id;
+        *static_cast<int*>(context) = id;
         return 0; // continue scanning
     }
 
     int HyperscanDB::FindRegex(const string& line)
     {
-        match_id_ = -1;
+        return FindRegex(line, scratch_);
+    }
+
+    int HyperscanDB::FindRegex(const string& line, hs_scratch_t* scratch) const
+    {
+        int match_id = -1;
+
+        if (scratch == nullptr) {
+            scratch = scratch_;
+        }
 
-        hs_error_t err = hs_scan(db_, line.c_str(), line.size(), 0, scratch_, OnMatch, this);
+        hs_error_t err = hs_scan(db_, line.c_str(), line.size(), 0, scratch, OnMatch, &match_id);
         if (err != HS_SUCCESS) {
             cerr << "ERROR: Unable to scan buffer: " << err << endl;
             return -1;
         }
 
-        return match_id_;
+        return match_id;
+    }
+
+    HyperscanScratch HyperscanDB::CloneScratch() const
+    {
+        hs_scratch_t* scratch = nullptr;
+        hs_error_t err = hs_clone_scratch(scratch_, &scratch);
+        if (err != HS_SUCCESS) {
+            cerr << "ERROR: could not allocate scratch space" << endl;
+            return nullptr;
+        }
+
+        return HyperscanScratch(scratch);
     }
 
 } // namespace logscan
@@ -1,6 +1,7 @@
 #ifndef LOGSCAN_HYPERSCANDB_H_
 #define LOGSCAN_HYPERSCANDB_H_
 
+#include <memory>
 #include <string>
 #include <hs/hs.h>
 
@@ -8,6 +9,14 @@
 
 namespace logscan
 {
+    struct HyperscanScratchDeleter
+    {
+        void operator()(hs_scratch_t* scratch) const { hs_free_scratch(scratch); }
+    };
+
+    // Scratch space for scanning the database from another thread
+    using HyperscanScratch = std::unique_ptr<hs_scratch_t, HyperscanScratchDeleter>;
+
     class HyperscanDB
     {
     public:
@@ -24,14 +33,22 @@ namespace logscan
 
         int FindRegex(const std::string& line);
 
+        // Thread-safe as long as each thread passes its own scratch space,
+        // nullptr means the scratch space of the database
+        int FindRegex(const std::string& line, hs_scratch_t* scratch) const;
+
+        HyperscanScratch CloneScratch() const;
+
+        // Memory used by the compiled database and the scratch space in bytes
+        size_t database_size() const;
+        size_t scratch_size() const;
+
     private:
         static int OnMatch(unsigned int id, unsigned long long from, unsigned long long to,
             unsigned int flags, void* context);
 
         hs_database_t* db_;
         hs_scratch_t* scratch_;
-
-        int match_id_;
     };
 } // namespace logscan
 
@@ -1,7 +1,12 @@
 #include "PCREDB.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <functional>
 #include <iostream>
+#include <sstream>
+#include <thread>
 
 using namespace std;
 
@@ -9,75 +14,209 @@ namespace logscan
 {
     PCREDB::PCREDB()
     : pcres_()
+    , match_limit_(0)
+    , select_fields_(false)
+    , fields_()
     {
     }
 
-    bool PCREDB::BuildFrom(const RegexArray& regexes)
+    void PCREDB::select_fields(unordered_set<string> fields)
     {
+        select_fields_ = true;
+        fields_ = std::move(fields);
+    }
+
+    bool PCREDB::BuildFrom(const RegexArray& regexes, PCRECompileMode mode, int num_threads)
+    {
+        pcres_.clear();
         for (int i = 0; i < regexes.size(); i++) {
-            const auto& regex = regexes.get(i);
+            unique_ptr<PCRE> pcre_data(new PCRE);
+            pcre_data->id = regexes.get(i).id;
+            pcre_data->pattern = regexes.get(i).pattern;
+            pcre_data->is_prefix = i == regexes.prefix_regex_index();
+            pcres_.emplace_back(std::move(pcre_data));
+        }
+
+        switch (mode) {
+        case PCRECompileMode::Eager:
+            return CompileAll();
+        case PCRECompileMode::Parallel:
+            return ForEachParallel(num_threads, [this](PCRE& pcre_data) { return EnsureCompiled(pcre_data); });
+        case PCRECompileMode::Lazy:
+            // Patterns are compiled on first use, but errors are still
+            // reported up front: PCRE rejects some patterns Hyperscan accepts
+            return ForEachParallel(num_threads, [](PCRE& pcre_data) { return Validate(pcre_data); });
+        }
+
+        return false;
+    }
+
+    pcre* PCREDB::CompilePattern(const PCRE& pcre_data)
+    {
+        const char* err;
+        int erroffset;
+        pcre* pcregex = pcre_compile(
+            pcre_data.pattern.c_str(),  /* the pattern */
+            0,                          /* default options */
+            &err,                       /* for error message */
+            &erroffset,                 /* for error offset */
+            nullptr);                   /* use default character tables */
+
+        if (pcregex == nullptr) {
+            // Build the message first so that lines from concurrent
+            // compilations are not interleaved
+            ostringstream message;
+            message << "PCRE compilation failed for regex id " << pcre_data.id
+                    << " at offset " << erroffset << ":" << err << endl;
+            cerr << message.str();
+        }
+
+        return pcregex;
+    }
+
+    bool PCREDB::Validate(const PCRE& pcre_data)
+    {
+        pcre* pcregex = CompilePattern(pcre_data);
+        if (pcregex == nullptr)
+            return false;
+
+        pcre_free(pcregex);
+        return true;
+    }
 
-            PCRE pcre_data;
+    bool PCREDB::Compile(PCRE& pcre_data) const
+    {
+        pcre_data.pcregex = CompilePattern(pcre_data);
+        if (pcre_data.pcregex == nullptr)
+            return false;
+
+        int name_count = 0;
+        pcre_fullinfo(
+            pcre_data.pcregex,      /* the compiled pattern */
+            nullptr,                /* no extra data - we didn't study the pattern */
+            PCRE_INFO_NAMECOUNT,    /* number of named substrings */
+            &name_count);           /* where to put the answer */
+
+        int max_group = 0;
+        if (name_count > 0) {
+            char* name_table = nullptr;
+            pcre_fullinfo(
+                pcre_data.pcregex,        /* the compiled pattern */
+                nullptr,                  /* no extra data - we didn't study the pattern */
+                PCRE_INFO_NAMETABLE,      /* address of the table */
+                &name_table);             /* where to put the answer */
+
+            int name_entry_size = 0;
+            pcre_fullinfo(
+                pcre_data.pcregex,           /* the compiled pattern */
+                nullptr,                     /* no extra data - we didn't study the pattern */
+                PCRE_INFO_NAMEENTRYSIZE,     /* size of each entry in the table */
+                &name_entry_size);           /* where to put the answer */
+
+            char* tabptr = name_table;
+            for (int i = 0; i < name_count; i++, tabptr += name_entry_size) {
+                const int n = (tabptr[0] << 8) | tabptr[1];
+                string name(tabptr + 2);
+                if (select_fields_ && fields_.count(name) == 0 && !(pcre_data.is_prefix && name == "details"))
+                    continue;
+
+                pcre_data.groups.emplace_back(n, std::move(name));
+                max_group = max(max_group, n);
+            }
+        }
 
-            const char* err;
-            int erroffset;
-            pcre_data.pcregex = pcre_compile(
-                regex.pattern.c_str(),  /* the pattern */
-                0,                      /* default options */
-                &err,                   /* for error message */
-                &erroffset,             /* for error offset */
-                nullptr);               /* use default character tables */
+        // Groups after the last extracted one do not need to be reported,
+        // without any the match is only confirmed
+        pcre_data.output_vector_size = pcre_data.groups.empty() ? 0 : (max_group + 1) * 3;
 
-            if (pcre_data.pcregex == nullptr) {
-                cerr << "PCRE compilation failed at offset " << erroffset << ":" << err << endl;
+        return true;
+    }
+
+    bool PCREDB::EnsureCompiled(PCRE& pcre_data) const
+    {
+        // A failed compilation is not retried: pcregex stays nullptr
+        call_once(pcre_data.compile_once, [this, &pcre_data]() { Compile(pcre_data); });
+        return pcre_data.pcregex != nullptr;
+    }
+
+    bool PCREDB::CompileAll()
+    {
+        for (auto& pcre_data : pcres_) {
+            if (!EnsureCompiled(*pcre_data))
                 return false;
+        }
+
+        return true;
+    }
 
-            } else {
-                pcre_fullinfo(
-                    pcre_data.pcregex,      /* the compiled pattern */
-                    nullptr,                /* no extra data - we didn't study the pattern */
-                    PCRE_INFO_NAMECOUNT,    /* number of named substrings */
-                    &pcre_data.name_count); /* where to put the answer */
-
-                if (pcre_data.name_count > 0) {
-                    pcre_fullinfo(
-                        pcre_data.pcregex,        /* the compiled pattern */
-                        nullptr,                  /* no extra data - we didn't study the pattern */
-                        PCRE_INFO_NAMETABLE,      /* address of the table */
-                        &pcre_data.name_table);   /* where to put the answer */
-
-                    pcre_fullinfo(
-                        pcre_data.pcregex,           /* the compiled pattern */
-                        nullptr,                     /* no extra data - we didn't study the pattern */
-                        PCRE_INFO_NAMEENTRYSIZE,     /* size of each entry in the table */
-                        &pcre_data.name_entry_size); /* where to put the answer */
+    bool PCREDB::ForEachParallel(int num_threads, const function<bool (PCRE&)>& fn)
+    {
+        if (num_threads <= 0) {
+            num_threads = max(1u, thread::hardware_concurrency());
+        }
+        num_threads = min(num_threads, static_cast<int>(pcres_.size()));
+
+        atomic<size_t> next_index(0);
+        atomic<bool> ok(true);
+        auto worker = [this, &fn, &next_index, &ok]() {
+            for (size_t i = next_index++; i < pcres_.size() && ok; i = next_index++) {
+                if (!fn(*pcres_[i])) {
+                    ok = false;
                 }
             }
+        };
 
-            pcres_.emplace_back(pcre_data);
+        vector<thread> threads;
+        for (int i = 0; i < num_threads; i++) {
+            threads.emplace_back(worker);
+        }
+        for (auto& t : threads) {
+            t.join();
         }
 
-        return true;
+        return ok;
     }
 
     PCREDB::~PCREDB()
     {
-        for (PCRE& pcre_data : pcres_) {
-            if (pcre_data.pcregex != nullptr) {
-                pcre_free(pcre_data.pcregex);
-                pcre_data.pcregex = nullptr;
+        for (auto& pcre_data : pcres_) {
+            if (pcre_data->pcregex != nullptr) {
+                pcre_free(pcre_data->pcregex);
+                pcre_data->pcregex = nullptr;
             }
         }
     }
 
+    size_t PCREDB::compiled_size(int index) const
+    {
+        const PCRE& pcre_data = *pcres_[index];
+        size_t size = 0;
+        if (pcre_data.pcregex != nullptr) {
+            pcre_fullinfo(
+                pcre_data.pcregex,  /* the compiled pattern */
+                nullptr,            /* no extra data - we didn't study the pattern */
+                PCRE_INFO_SIZE,     /* size of the compiled pattern */
+                &size);             /* where to put the answer */
+        }
+        return size;
+    }
+
     PCREMatchResult PCREDB::MatchRegex(int index, const std::string& line, CaptureGroups& capture_groups) const
     {
-        const PCRE& pcre_data = pcres_[index];
+        PCRE& pcre_data = *pcres_[index];
+        if (!EnsureCompiled(pcre_data))
+            return PCREMatchResult::Error;
+
+        pcre_extra extra = {};
+        if (match_limit_ != 0) {
+            extra.flags = PCRE_EXTRA_MATCH_LIMIT;
+            extra.match_limit = match_limit_;
+        }
 
-        vector<int> output_vector((pcre_data.name_count + 1) * 3);
+        vector<int> output_vector(pcre_data.output_vector_size);
         const int rc = pcre_exec(
             pcre_data.pcregex,     /* the compiled pattern */
-            nullptr,               /* no extra data - we didn't study the pattern */
+            match_limit_ != 0 ? &extra : nullptr, /* only used for the match limit */
             line.c_str(),          /* the subject string */
             line.size(),           /* the length of the subject */
             0,                     /* start at offset 0 in the subject */
@@ -89,23 +228,18 @@ namespace logscan
             switch(rc) {
             case PCRE_ERROR_NOMATCH:
                 return PCREMatchResult::NoMatch;
+            case PCRE_ERROR_MATCHLIMIT:
+                return PCREMatchResult::MatchLimit;
             default:
                 cerr << "PCRE matching error: " << rc << endl;
                 return PCREMatchResult::Error;
             }
         }
 
-        if (pcre_data.name_count > 0) {
-            char* tabptr = pcre_data.name_table;
-
-            for (int i = 0; i < pcre_data.name_count; i++) {
-                const int n = (tabptr[0] << 8) | tabptr[1];
-
-                string key(tabptr + 2);
-                string value(line.c_str() + output_vector[2*n], output_vector[2*n+1] - output_vector[2*n]);
-                capture_groups[std::move(key)] = std::move(value);
-                tabptr += pcre_data.name_entry_size;
-            }
+        for (const auto& group : pcre_data.groups) {
+            const int n = group.first;
+            string value(line.c_str() + output_vector[2*n], output_vector[2*n+1] - output_vector[2*n]);
+            capture_groups[group.second] = std::move(value);
         }
 
         return PCREMatchResult::OK;
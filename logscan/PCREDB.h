@@ -1,8 +1,14 @@
 #ifndef LOGSCAN_PCREDB_H_
 #define LOGSCAN_PCREDB_H_
 
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <pcre.h>
 
 #include "RegexArray.h"
@@ -15,9 +21,17 @@ namespace logscan
     {
         OK,
         NoMatch,
+        MatchLimit,     // gave up after too much backtracking, see set_match_limit()
         Error,
     };
 
+    enum class PCRECompileMode
+    {
+        Eager,      // compile every pattern up front on the calling thread
+        Parallel,   // compile every pattern up front on a pool of threads
+        Lazy,       // check every pattern up front, compile it the first time it is matched
+    };
+
     class PCREDB
     {
     public:
@@ -30,20 +44,49 @@ namespace logscan
         PCREDB(PCREDB&&) = default;
         PCREDB& operator=(PCREDB&&) = default;
 
-        bool BuildFrom(const RegexArray& regexes);
+        // num_threads is used to compile the patterns in Parallel mode and to
+        // check them in Lazy mode, 0 means one per core
+        bool BuildFrom(const RegexArray& regexes,
+            PCRECompileMode mode = PCRECompileMode::Lazy, int num_threads = 0);
 
         PCREMatchResult MatchRegex(int index, const std::string& line, CaptureGroups& capture_groups) const;
 
+        // Memory used by the compiled pattern in bytes, 0 if it is not compiled
+        size_t compiled_size(int index) const;
+
+        // Limit the number of internal match() calls of a single pcre_exec(),
+        // 0 means the PCRE library default
+        void set_match_limit(unsigned long match_limit) { match_limit_ = match_limit; }
+
+        // Only extract the named groups in fields. Must be called before
+        // BuildFrom(). Every pattern is still executed to confirm the match.
+        void select_fields(std::unordered_set<std::string> fields);
+
     private:
         struct PCRE
         {
+            std::string id;
+            std::string pattern;
+            bool is_prefix = false;     // keeps its "details" group whatever the selected fields
+            std::once_flag compile_once;
             pcre* pcregex = nullptr;
-            int name_count = 0;
-            int name_entry_size = 0;
-            char* name_table = nullptr;
+            std::vector<std::pair<int, std::string>> groups;    // number and name of the extracted groups
+            int output_vector_size = 0;
         };
 
-        std::vector<PCRE> pcres_;
+        static pcre* CompilePattern(const PCRE& pcre_data);
+        static bool Validate(const PCRE& pcre_data);
+        bool Compile(PCRE& pcre_data) const;
+        bool EnsureCompiled(PCRE& pcre_data) const;
+
+        bool CompileAll();
+        bool ForEachParallel(int num_threads, const std::function<bool (PCRE&)>& fn);
+
+        // PCRE holds a once_flag which is neither copyable nor movable
+        std::vector<std::unique_ptr<PCRE>> pcres_;
+        unsigned long match_limit_;
+        bool select_fields_;
+        std::unordered_set<std::string> fields_;
     };
 } // namespace logscan
 
@@ -0,0 +1,253 @@
+#include "PatternProfiler.h"
+
+#include "Clock.h"
+#include "Scanner.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+namespace logscan
+{
+    namespace
+    {
+        void PrintProfileHeader(ostream& output_stream)
+        {
+            output_stream << "rank\tid\ttotal_sec\ths_scan_sec\ths_compile_sec\ths_db_bytes_added\ths_db_bytes_standalone"
+                             "\ths_scratch_bytes_standalone\ths_matches\tpcre_sec\tpcre_bytes\tpcre_match_limit_hits" << endl;
+        }
+
+        void PrintProfile(ostream& output_stream, const string& rank, const PatternProfile& profile)
+        {
+            output_stream << rank
+                          << "\t" << profile.regex_id
+                          << "\t" << profile.total_seconds()
+                          << "\t" << profile.hs_scan_seconds
+                          << "\t" << profile.hs_compile_seconds
+                          << "\t" << profile.hs_database_bytes_added
+                          << "\t" << profile.hs_database_bytes_standalone
+                          << "\t" << profile.hs_scratch_bytes_standalone
+                          << "\t" << profile.hs_matches
+                          << "\t" << profile.pcre_seconds
+                          << "\t" << profile.pcre_bytes
+                          << "\t" << profile.pcre_match_limit_hits
+                          << endl;
+        }
+    } // namespace
+
+    PatternProfiler::PatternProfiler(unsigned long match_limit)
+    : only_ids_()
+    , regex_array_()
+    , hs_db_()
+    , pcre_db_()
+    , match_limit_(match_limit)
+    , lines_()
+    , messages_()
+    , profiles_()
+    , has_prefix_profile_(false)
+    , prefix_profile_()
+    , hs_scan_seconds_(0.0)
+    , hs_baseline_database_bytes_(0)
+    {
+    }
+
+    bool PatternProfiler::BuildFrom(const char* patterns_file)
+    {
+        if (!regex_array_.LoadFromFile(patterns_file))
+            return false;
+
+        return Build();
+    }
+
+    bool PatternProfiler::BuildFrom(istream& patterns_stream)
+    {
+        if (!regex_array_.LoadFromFile(patterns_stream))
+            return false;
+
+        return Build();
+    }
+
+    void PatternProfiler::select_ids(unordered_set<string> ids)
+    {
+        only_ids_ = std::move(ids);
+    }
+
+    bool PatternProfiler::Build()
+    {
+        if (!only_ids_.empty()) {
+            regex_array_.Select(only_ids_);
+            const int num_prefix = regex_array_.prefix_regex_index() != -1 ? 1 : 0;
+            if (regex_array_.size() == num_prefix) {
+                cerr << "ERROR: None of the selected regex ids exist" << endl;
+                return false;
+            }
+        }
+
+        if (!hs_db_.BuildFrom(regex_array_))
+            return false;
+
+        if (!pcre_db_.BuildFrom(regex_array_, PCRECompileMode::Eager))
+            return false;
+
+        // Hyperscan cannot compile an empty database, one literal comes closest
+        RegexArray trivial_regex;
+        trivial_regex.AddRegex("baseline", "a", 0);
+        HyperscanDB baseline_db;
+        if (!baseline_db.BuildFrom(trivial_regex))
+            return false;
+        hs_baseline_database_bytes_ = baseline_db.database_size();
+
+        return true;
+    }
+
+    void PatternProfiler::AddSample(istream& input_stream)
+    {
+        const int prefix_index = regex_array_.prefix_regex_index();
+        for (string line; getline(input_stream, line); ) {
+            StripLineEnding(line);
+
+            string message = line;
+            if (prefix_index != -1) {
+                CaptureGroups capture_groups;
+                if (pcre_db_.MatchRegex(prefix_index, line, capture_groups) == PCREMatchResult::OK) {
+                    const auto details_it = capture_groups.find("details");
+                    if (details_it != capture_groups.end()) {
+                        message = std::move(details_it->second);
+                    }
+                }
+            }
+
+            lines_.emplace_back(std::move(line));
+            messages_.emplace_back(std::move(message));
+        }
+    }
+
+    bool PatternProfiler::ProfilePattern(int index, PatternProfile& profile)
+    {
+        const auto& regex = regex_array_.get(index);
+        profile.regex_id = regex.id;
+
+        RegexArray single_regex;
+        single_regex.AddRegex(regex.id, regex.pattern, regex.flags);
+
+        Clock clock;
+        clock.start();
+        HyperscanDB single_db;
+        if (!single_db.BuildFrom(single_regex))
+            return false;
+        clock.stop();
+        profile.hs_compile_seconds = clock.seconds();
+        profile.hs_database_bytes_standalone = single_db.database_size();
+        profile.hs_database_bytes_added = profile.hs_database_bytes_standalone > hs_baseline_database_bytes_
+            ? profile.hs_database_bytes_standalone - hs_baseline_database_bytes_ : 0;
+        profile.hs_scratch_bytes_standalone = single_db.scratch_size();
+        profile.pcre_bytes = pcre_db_.compiled_size(index);
+
+        vector<const string*> matched;
+        clock.start();
+        for (const string& message : messages_) {
+            if (single_db.FindRegex(message) != -1) {
+                matched.push_back(&message);
+            }
+        }
+        clock.stop();
+        profile.hs_scan_seconds = clock.seconds();
+        profile.hs_matches = matched.size();
+
+        // The Scanner runs the prefix regex on every line as read, the others
+        // on the messages Hyperscan matched
+        vector<const string*> subjects;
+        if (index == regex_array_.prefix_regex_index()) {
+            for (const string& line : lines_) {
+                subjects.push_back(&line);
+            }
+        } else {
+            subjects = std::move(matched);
+        }
+
+        // Timed without the profiler's limit, so that an aborted pathological
+        // match does not look cheap
+        pcre_db_.set_match_limit(0);
+        clock.start();
+        for (const string* subject : subjects) {
+            CaptureGroups capture_groups;
+            pcre_db_.MatchRegex(index, *subject, capture_groups);
+        }
+        clock.stop();
+        profile.pcre_seconds = clock.seconds();
+
+        pcre_db_.set_match_limit(match_limit_);
+        for (const string* subject : subjects) {
+            CaptureGroups capture_groups;
+            if (pcre_db_.MatchRegex(index, *subject, capture_groups) == PCREMatchResult::MatchLimit) {
+                profile.pcre_match_limit_hits++;
+            }
+        }
+        pcre_db_.set_match_limit(0);
+
+        return true;
+    }
+
+    bool PatternProfiler::Run()
+    {
+        // Baseline: the whole database as the Scanner uses it
+        Clock clock;
+        clock.start();
+        for (const string& message : messages_) {
+            hs_db_.FindRegex(message);
+        }
+        clock.stop();
+        hs_scan_seconds_ = clock.seconds();
+
+        profiles_.clear();
+        has_prefix_profile_ = false;
+        for (int i = 0; i < regex_array_.size(); i++) {
+            PatternProfile profile;
+            if (!ProfilePattern(i, profile))
+                return false;
+
+            if (i == regex_array_.prefix_regex_index()) {
+                prefix_profile_ = std::move(profile);
+                has_prefix_profile_ = true;
+            } else {
+                profiles_.emplace_back(std::move(profile));
+            }
+        }
+
+        stable_sort(profiles_.begin(), profiles_.end(),
+            [](const PatternProfile& a, const PatternProfile& b) {
+                if (a.pcre_match_limit_hits != b.pcre_match_limit_hits)
+                    return a.pcre_match_limit_hits > b.pcre_match_limit_hits;
+                return a.total_seconds() > b.total_seconds();
+            });
+
+        return true;
+    }
+
+    void PatternProfiler::PrintReport(ostream& output_stream) const
+    {
+        output_stream << "Sample lines: " << messages_.size() << endl;
+        output_stream << "Hyperscan scanning time with all patterns (sec): " << hs_scan_seconds_ << endl;
+        output_stream << "Hyperscan database size with all patterns (bytes): " << hs_db_.database_size() << endl;
+        output_stream << "Hyperscan scratch size with all patterns (bytes): " << hs_db_.scratch_size() << endl;
+        output_stream << "Hyperscan database size with one trivial pattern (bytes): " << hs_baseline_database_bytes_ << endl;
+        output_stream << "PCRE match limit for pcre_match_limit_hits: " << match_limit_ << endl;
+        output_stream << endl;
+
+        if (has_prefix_profile_) {
+            output_stream << "Prefix regex, PCRE run on every line, not ranked:" << endl;
+            PrintProfileHeader(output_stream);
+            PrintProfile(output_stream, "-", prefix_profile_);
+            output_stream << endl;
+        }
+
+        PrintProfileHeader(output_stream);
+        int rank = 1;
+        for (const auto& profile : profiles_) {
+            PrintProfile(output_stream, to_string(rank++), profile);
+        }
+    }
+
+} // namespace logscan
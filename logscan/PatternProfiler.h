@@ -0,0 +1,93 @@
+#ifndef LOGSCAN_PATTERNPROFILER_H_
+#define LOGSCAN_PATTERNPROFILER_H_
+
+#include <iosfwd>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "HyperscanDB.h"
+#include "PCREDB.h"
+#include "RegexArray.h"
+
+namespace logscan
+{
+    struct PatternProfile
+    {
+        std::string regex_id;
+
+        // Hyperscan cost of the pattern compiled into a database on its own
+        double hs_compile_seconds = 0.0;
+        double hs_scan_seconds = 0.0;
+        size_t hs_database_bytes_standalone = 0;
+        // Standalone size minus the size of a database with one trivial
+        // pattern, which approximates the fixed overhead of any database
+        size_t hs_database_bytes_added = 0;
+        // Scratch space is not additive: the full database needs about as
+        // much as its most demanding pattern
+        size_t hs_scratch_bytes_standalone = 0;
+        int hs_matches = 0;
+
+        // PCRE extraction cost on the lines Hyperscan matched, timed with the
+        // library default match limit
+        double pcre_seconds = 0.0;
+        size_t pcre_bytes = 0;
+        // Lines on which the profiler's (lower) match limit was exceeded
+        int pcre_match_limit_hits = 0;
+
+        double total_seconds() const { return hs_scan_seconds + pcre_seconds; }
+    };
+
+    // Measures the cost of every pattern on a sample corpus so that
+    // pathological patterns can be found before they reach production
+    class PatternProfiler
+    {
+    public:
+        explicit PatternProfiler(unsigned long match_limit = 10000);
+        ~PatternProfiler() = default;
+
+        PatternProfiler(const PatternProfiler&) = delete;
+        PatternProfiler& operator=(const PatternProfiler&) = delete;
+
+        // Only profile the regexes with these ids, must be called before BuildFrom
+        void select_ids(std::unordered_set<std::string> ids);
+
+        bool BuildFrom(const char* patterns_file);
+        bool BuildFrom(std::istream& patterns_stream);
+
+        // Append the lines of input_stream to the sample corpus
+        void AddSample(std::istream& input_stream);
+
+        bool Run();
+
+        // Patterns exceeding the match limit first, then by decreasing total
+        // time. The prefix regex is reported on its own: the Scanner runs it
+        // on every line, before the other patterns.
+        void PrintReport(std::ostream& output_stream) const;
+
+        // Ranked like in the report, without the prefix regex
+        const std::vector<PatternProfile>& profiles() const { return profiles_; }
+
+    private:
+        bool Build();
+        bool ProfilePattern(int index, PatternProfile& profile);
+
+        std::unordered_set<std::string> only_ids_;
+        RegexArray regex_array_;
+        HyperscanDB hs_db_;
+        PCREDB pcre_db_;
+        unsigned long match_limit_;
+
+        // Lines of the sample corpus as read, and stripped of the prefix like
+        // the Scanner does before running Hyperscan
+        std::vector<std::string> lines_;
+        std::vector<std::string> messages_;
+        std::vector<PatternProfile> profiles_;
+        bool has_prefix_profile_;
+        PatternProfile prefix_profile_;
+        double hs_scan_seconds_;
+        size_t hs_baseline_database_bytes_;
+    };
+} // namespace logscan
+
+#endif  // LOGSCAN_PATTERNPROFILER_H_
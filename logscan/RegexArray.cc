@@ -22,6 +22,25 @@ namespace logscan
         regexes_.emplace_back(Regex { id, pattern, flags });
     }
 
+    void RegexArray::Select(const unordered_set<string>& ids)
+    {
+        vector<Regex> regexes;
+        regexes.swap(regexes_);
+        prefix_regex_index_ = -1;
+
+        unordered_set<string> missing_ids(ids);
+        for (auto& regex : regexes) {
+            missing_ids.erase(regex.id);
+            if (regex.id == "prefix" || ids.count(regex.id) != 0) {
+                AddRegex(regex.id, regex.pattern, regex.flags);
+            }
+        }
+
+        for (const auto& id : missing_ids) {
+            cerr << "WARNING: No regex with id: " << id << endl;
+        }
+    }
+
     bool RegexArray::LoadFromFile(const char* filename)
     {
         ifstream input_stream(filename);
@@ -3,6 +3,7 @@
 
 #include <iosfwd>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 namespace logscan
@@ -31,6 +32,9 @@ namespace logscan
 
         void AddRegex(const std::string& id, const std::string& pattern, unsigned int flags);
 
+        // Drop every regex not in ids, except the prefix regex
+        void Select(const std::unordered_set<std::string>& ids);
+
         int size() const { return regexes_.size(); }
         const Regex& get(int index) const { return regexes_[index]; }
 
@@ -8,12 +8,12 @@ using namespace std;
 
 namespace logscan
 {
-    Scanner::Scanner(ScannerMatchFn match_fn, bool perf_stats)
+    Scanner::Scanner(ScannerMatchFn match_fn, const ScannerOptions& options)
     : regex_array_()
     , hs_db_()
     , pcre_db_()
     , match_fn_(std::move(match_fn))
-    , perf_stats_(perf_stats)
+    , options_(options)
     {
     }
 
@@ -26,44 +26,81 @@ namespace logscan
         if (!regex_array_.LoadFromFile(patterns_file))
             return false;
 
+        return Build();
+    }
+
+    bool Scanner::BuildFrom(istream& patterns_stream)
+    {
+        if (!regex_array_.LoadFromFile(patterns_stream))
+            return false;
+
+        return Build();
+    }
+
+    bool Scanner::Build()
+    {
+        if (!options_.only_ids.empty()) {
+            regex_array_.Select(options_.only_ids);
+            const int num_prefix = regex_array_.prefix_regex_index() != -1 ? 1 : 0;
+            if (regex_array_.size() == num_prefix) {
+                cerr << "ERROR: None of the selected regex ids exist" << endl;
+                return false;
+            }
+        }
+
+        if (options_.select_fields) {
+            pcre_db_.select_fields(options_.fields);
+        }
+
         Clock clock;
         clock.start();
         if (!hs_db_.BuildFrom(regex_array_))
             return false;
         clock.stop();
-        if (perf_stats_) {
+        if (options_.perf_stats) {
             cerr << "Hyperscan DB compilation time (sec): " << clock.seconds() << endl;
         }
 
         clock.start();
-        if (!pcre_db_.BuildFrom(regex_array_))
+        if (!pcre_db_.BuildFrom(regex_array_, options_.pcre_compile_mode, options_.pcre_compile_threads))
             return false;
         clock.stop();
-        if (perf_stats_) {
-            cerr << "PCRE compilation time (sec): " << clock.seconds() << endl;
+        if (options_.perf_stats) {
+            if (options_.pcre_compile_mode == PCRECompileMode::Lazy) {
+                cerr << "PCRE pattern check time (sec): " << clock.seconds()
+                     << " (lazy, each pattern is compiled on its first match)" << endl;
+            } else {
+                cerr << "PCRE compilation time (sec): " << clock.seconds() << endl;
+            }
         }
 
         return true;
     }
 
-    bool Scanner::ProcessLine(const string& line, MatchResults& results)
+    bool Scanner::ProcessLine(const string& line, MatchResults& results, hs_scratch_t* scratch) const
     {
-        CaptureGroups::iterator details_it = results.capture_groups.end();
-        if (regex_array_.prefix_regex_index() != -1) {
-            if (pcre_db_.MatchRegex(regex_array_.prefix_regex_index(), line, results.capture_groups) == PCREMatchResult::OK) {
-                details_it = results.capture_groups.find("details");
+        // The message after the prefix, it is not part of the output
+        string details;
+        bool has_details = false;
+        const int prefix_index = regex_array_.prefix_regex_index();
+        if (prefix_index != -1) {
+            const PCREMatchResult result = pcre_db_.MatchRegex(prefix_index, line, results.capture_groups);
+            if (result == PCREMatchResult::OK) {
                 // prefix_regex must contain a capture group named "details"
+                const auto details_it = results.capture_groups.find("details");
+                if (details_it != results.capture_groups.end()) {
+                    details = std::move(details_it->second);
+                    results.capture_groups.erase(details_it);
+                    has_details = true;
+                }
+            } else if (result == PCREMatchResult::MatchLimit) {
+                cerr << "PCRE match limit exceeded for regex id: " << regex_array_.get(prefix_index).id << endl;
             }
         }
 
-        const string* message = nullptr;
-        if (details_it != results.capture_groups.end()) {
-            message = &details_it->second;
-        } else {
-            message = &line;
-        }
+        const string* message = has_details ? &details : &line;
 
-        const int regex_index = hs_db_.FindRegex(*message);
+        const int regex_index = hs_db_.FindRegex(*message, scratch);
         if (regex_index == -1) {
             results.regex_id = "";
             return false;
@@ -75,14 +112,15 @@ namespace logscan
             if (result == PCREMatchResult::NoMatch) {
                 // This can happen as PCRE does a greedy match while HS doesn't
                 cerr << "Mismatch between Hyperscan and PCRE for regex id: " << results.regex_id << endl;
+            } else if (result == PCREMatchResult::MatchLimit) {
+                // The line is dropped, too much backtracking
+                cerr << "PCRE match limit exceeded for regex id: " << results.regex_id << endl;
+            } else {
+                cerr << "PCRE error, line dropped for regex id: " << results.regex_id << endl;
             }
             return false;
         }
 
-        if (details_it != results.capture_groups.end()) {
-            results.capture_groups.erase(details_it); // delete "details" from the output
-        }
-
         return true;
     }
 
@@ -93,13 +131,10 @@ namespace logscan
         int total_lines = 0;
         int total_bytes = 0;
         for (string line; getline(input_stream, line); ) {
-            // Support both Windows and macOS/Linux line endings
-            if (!line.empty() && line.back() == '\r') {
-                line.pop_back();
-            }
+            StripLineEnding(line);
 
             MatchResults results;
-            if (ProcessLine(line, results)) {
+            if (ProcessLine(line, results, nullptr)) {
                 match_fn_(results);
             }
 
@@ -107,7 +142,7 @@ namespace logscan
             total_bytes += line.size();
         }
         clock.stop();
-        if (perf_stats_) {
+        if (options_.perf_stats) {
             cerr << "Total scanning time (sec): " << clock.seconds() << endl;
             cerr << "Total number of lines: " << total_lines << endl;
             cerr << "Total bytes: " << total_bytes << endl;
@@ -117,6 +152,14 @@ namespace logscan
         return true;
     }
 
+    void StripLineEnding(string& line)
+    {
+        // Support both Windows and macOS/Linux line endings
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+    }
+
     void PrintJSONMatchFn(const MatchResults& results, ostream& output_stream)
     {
         output_stream << "{ \"id\": \"" << results.regex_id << "\"";
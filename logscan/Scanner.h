@@ -3,6 +3,7 @@
 
 #include <functional>
 #include <string>
+#include <unordered_set>
 
 #include "HyperscanDB.h"
 #include "PCREDB.h"
@@ -18,10 +19,27 @@ namespace logscan
 
     using ScannerMatchFn = std::function<void (const MatchResults& results)>;
 
+    struct ScannerOptions
+    {
+        bool perf_stats = false;
+        PCRECompileMode pcre_compile_mode = PCRECompileMode::Lazy;
+        int pcre_compile_threads = 0;   // 0 means one per core
+
+        // Only match the regexes with these ids, all of them if empty. The
+        // others are not compiled, so a line matching several regexes is
+        // reported under the last selected one, which may not be the one a
+        // full run reports.
+        std::unordered_set<std::string> only_ids;
+
+        // Only extract the named groups in fields
+        bool select_fields = false;
+        std::unordered_set<std::string> fields;
+    };
+
     class Scanner
     {
     public:
-        explicit Scanner(ScannerMatchFn match_fn, bool perf_stats = false);
+        explicit Scanner(ScannerMatchFn match_fn, const ScannerOptions& options = ScannerOptions());
         ~Scanner();
 
         Scanner(const Scanner&) = delete;
@@ -31,21 +49,32 @@ namespace logscan
         Scanner& operator=(Scanner&&) = default;
 
         bool BuildFrom(const char* patterns_file);
+        bool BuildFrom(std::istream& patterns_stream);
 
         bool ScanStream(std::istream& input_stream);
 
+        // Matches a single line without calling the match function. Can be
+        // called from several threads at once if each one passes its own
+        // scratch space, nullptr means the scratch space of the Scanner.
+        bool ProcessLine(const std::string& line, MatchResults& match_results, hs_scratch_t* scratch) const;
+
+        HyperscanScratch CloneScratch() const { return hs_db_.CloneScratch(); }
+
     private:
-        bool ProcessLine(const std::string& line, MatchResults& match_results);
+        bool Build();
 
         RegexArray regex_array_;
         HyperscanDB hs_db_;
         PCREDB pcre_db_;
         ScannerMatchFn match_fn_;
-        bool perf_stats_;
+        ScannerOptions options_;
     };
 
     void PrintJSONMatchFn(const MatchResults& results, std::ostream& output_stream);
 
+    // Removes the '\r' of a line read up to its '\n'
+    void StripLineEnding(std::string& line);
+
 } // namespace logscan
 
 #endif  // LOGSCAN_SCANNER_H_
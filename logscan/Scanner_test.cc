@@ -1,10 +1,383 @@
 #include "logscan.h"
 
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
 #include <gtest/gtest.h>
 
 using namespace logscan;
 
+namespace
+{
+    RegexArray LoadRegexes(const char* patterns)
+    {
+        std::istringstream patterns_stream(patterns);
+        RegexArray regex_array;
+        EXPECT_TRUE(regex_array.LoadFromFile(patterns_stream));
+        return regex_array;
+    }
+
+    const char* const kPatterns =
+        "# comment\n"
+        "login:/user (?<user>\\w+) logged in from (?<host>[\\w.]+)/\n"
+        "logout:/user (?<user>\\w+) logged out/\n";
+
+#ifdef __linux__
+    std::string TempSocketPath()
+    {
+        return "/tmp/logscan_test_" + std::to_string(getpid()) + ".sock";
+    }
+
+    int ConnectTo(const std::string& path)
+    {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd != -1 && connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+#endif
+} // namespace
+
 TEST(Scanner, Test1)
 {
 
 }
+
+TEST(PCREDB, CompileModesGiveTheSameCaptures)
+{
+    const RegexArray regex_array = LoadRegexes(kPatterns);
+    ASSERT_EQ(2, regex_array.size());
+
+    const std::string line = "user alice logged in from example.org";
+    for (const PCRECompileMode mode : { PCRECompileMode::Eager, PCRECompileMode::Parallel, PCRECompileMode::Lazy }) {
+        PCREDB pcre_db;
+        ASSERT_TRUE(pcre_db.BuildFrom(regex_array, mode, 2));
+
+        CaptureGroups capture_groups;
+        ASSERT_EQ(PCREMatchResult::OK, pcre_db.MatchRegex(0, line, capture_groups));
+        EXPECT_EQ(2u, capture_groups.size());
+        EXPECT_EQ("alice", capture_groups["user"]);
+        EXPECT_EQ("example.org", capture_groups["host"]);
+
+        capture_groups.clear();
+        EXPECT_EQ(PCREMatchResult::NoMatch, pcre_db.MatchRegex(1, line, capture_groups));
+        EXPECT_TRUE(capture_groups.empty());
+    }
+}
+
+TEST(PCREDB, CompilationErrorsAreReportedUpFront)
+{
+    RegexArray regex_array;
+    regex_array.AddRegex("valid", "valid", 0);
+    regex_array.AddRegex("broken", "((unbalanced", 0);
+
+    for (const PCRECompileMode mode : { PCRECompileMode::Eager, PCRECompileMode::Parallel, PCRECompileMode::Lazy }) {
+        PCREDB pcre_db;
+        EXPECT_FALSE(pcre_db.BuildFrom(regex_array, mode, 2));
+    }
+}
+
+TEST(PCREDB, CompiledSize)
+{
+    const RegexArray regex_array = LoadRegexes(kPatterns);
+
+    PCREDB eager_db;
+    ASSERT_TRUE(eager_db.BuildFrom(regex_array, PCRECompileMode::Eager));
+    EXPECT_GT(eager_db.compiled_size(0), 0u);
+    EXPECT_GT(eager_db.compiled_size(1), 0u);
+
+    PCREDB lazy_db;
+    ASSERT_TRUE(lazy_db.BuildFrom(regex_array, PCRECompileMode::Lazy));
+    EXPECT_EQ(0u, lazy_db.compiled_size(0));
+
+    CaptureGroups capture_groups;
+    lazy_db.MatchRegex(0, "user bob logged in from localhost", capture_groups);
+    EXPECT_EQ(eager_db.compiled_size(0), lazy_db.compiled_size(0));
+    EXPECT_EQ(0u, lazy_db.compiled_size(1));
+}
+
+TEST(PCREDB, MatchLimit)
+{
+    RegexArray regex_array;
+    regex_array.AddRegex("backtracking", "(a+)+b", 0);
+
+    PCREDB pcre_db;
+    ASSERT_TRUE(pcre_db.BuildFrom(regex_array, PCRECompileMode::Eager));
+
+    CaptureGroups capture_groups;
+    EXPECT_EQ(PCREMatchResult::OK, pcre_db.MatchRegex(0, "aab", capture_groups));
+
+    pcre_db.set_match_limit(1000);
+    const std::string subject = std::string(30, 'a') + "cb";
+    EXPECT_EQ(PCREMatchResult::MatchLimit, pcre_db.MatchRegex(0, subject, capture_groups));
+    EXPECT_EQ(PCREMatchResult::OK, pcre_db.MatchRegex(0, "aab", capture_groups));
+}
+
+TEST(PatternProfiler, BacktrackingPatternRanksFirst)
+{
+    PatternProfiler profiler(1000);
+    std::istringstream patterns_stream(
+        "ok:/hello (?<name>\\w+)/\n"
+        "backtracking:/(a+)+b/\n");
+    ASSERT_TRUE(profiler.BuildFrom(patterns_stream));
+
+    std::istringstream input_stream(
+        std::string(20, 'a') + "c ab\n"
+        "hello world\n");
+    profiler.AddSample(input_stream);
+    ASSERT_TRUE(profiler.Run());
+
+    const auto& profiles = profiler.profiles();
+    ASSERT_EQ(2u, profiles.size());
+    EXPECT_EQ("backtracking", profiles[0].regex_id);
+    EXPECT_GT(profiles[0].pcre_match_limit_hits, 0);
+    EXPECT_EQ(0, profiles[1].pcre_match_limit_hits);
+    for (const auto& profile : profiles) {
+        EXPECT_EQ(1, profile.hs_matches);
+        EXPECT_GT(profile.hs_database_bytes_standalone, 0u);
+        EXPECT_GT(profile.hs_scratch_bytes_standalone, 0u);
+        EXPECT_GT(profile.pcre_bytes, 0u);
+    }
+}
+
+#ifdef __linux__
+TEST(Server, RoundTripKeepsOrder)
+{
+    std::istringstream patterns_stream("seq:/line (?<n>\\d+)/\n");
+    Scanner scanner{ ScannerMatchFn() };
+    ASSERT_TRUE(scanner.BuildFrom(patterns_stream));
+
+    ServerOptions options;
+    options.unix_socket_path = TempSocketPath();
+    options.num_workers = 4;
+    // Small enough to exercise the backpressure
+    options.max_pending_bytes = 4096;
+    Server server(scanner, options);
+    ASSERT_TRUE(server.Listen());
+    std::thread server_thread([&server]() { server.Run(); });
+
+    const int fd = ConnectTo(options.unix_socket_path);
+    ASSERT_NE(-1, fd);
+
+    const int num_lines = 10000;
+    std::thread writer([fd]() {
+        std::ostringstream input;
+        for (int i = 0; i < num_lines; i++) {
+            input << (i % 2 == 0 ? "line " : "other ") << i << "\n";
+        }
+        const std::string data = input.str();
+        for (size_t written = 0; written < data.size(); ) {
+            const ssize_t n = write(fd, data.data() + written, data.size() - written);
+            ASSERT_GT(n, 0);
+            written += n;
+        }
+        shutdown(fd, SHUT_WR);
+    });
+
+    std::string output;
+    char buffer[4096];
+    for (ssize_t n; (n = read(fd, buffer, sizeof(buffer))) > 0; ) {
+        output.append(buffer, n);
+    }
+    writer.join();
+    close(fd);
+
+    server.Stop();
+    server_thread.join();
+
+    std::istringstream output_stream(output);
+    int expected = 0;
+    for (std::string line; getline(output_stream, line); expected += 2) {
+        EXPECT_EQ("{ \"id\": \"seq\", \"n\": \"" + std::to_string(expected) + "\" }", line);
+    }
+    EXPECT_EQ(num_lines, expected);
+}
+
+TEST(Server, ListenRefusesToReplaceAFile)
+{
+    const std::string path = TempSocketPath();
+    std::ofstream(path) << "not a socket";
+
+    std::istringstream patterns_stream("seq:/line/\n");
+    Scanner scanner{ ScannerMatchFn() };
+    ASSERT_TRUE(scanner.BuildFrom(patterns_stream));
+
+    ServerOptions options;
+    options.unix_socket_path = path;
+    {
+        Server server(scanner, options);
+        EXPECT_FALSE(server.Listen());
+    }
+
+    // Neither Listen() nor the destructor removed the file
+    std::ifstream file(path);
+    std::string content;
+    getline(file, content);
+    EXPECT_EQ("not a socket", content);
+    unlink(path.c_str());
+}
+
+TEST(Server, ListenRefusesALiveSocket)
+{
+    std::istringstream patterns_stream("seq:/line/\n");
+    Scanner scanner{ ScannerMatchFn() };
+    ASSERT_TRUE(scanner.BuildFrom(patterns_stream));
+
+    ServerOptions options;
+    options.unix_socket_path = TempSocketPath();
+    Server first(scanner, options);
+    ASSERT_TRUE(first.Listen());
+
+    Server second(scanner, options);
+    EXPECT_FALSE(second.Listen());
+}
+
+TEST(Server, LineLongerThanPendingBytesDisconnects)
+{
+    std::istringstream patterns_stream("seq:/line/\n");
+    Scanner scanner{ ScannerMatchFn() };
+    ASSERT_TRUE(scanner.BuildFrom(patterns_stream));
+
+    ServerOptions options;
+    options.unix_socket_path = TempSocketPath();
+    options.max_pending_bytes = 64;
+    Server server(scanner, options);
+    ASSERT_TRUE(server.Listen());
+    std::thread server_thread([&server]() { server.Run(); });
+
+    const int fd = ConnectTo(options.unix_socket_path);
+    ASSERT_NE(-1, fd);
+
+    // Under max_line_bytes, the client must not wait for a line that can
+    // never be read
+    const std::string data(256, 'x');
+    ASSERT_EQ(static_cast<ssize_t>(data.size()), write(fd, data.data(), data.size()));
+    char buffer[64];
+    EXPECT_EQ(0, read(fd, buffer, sizeof(buffer)));
+    close(fd);
+
+    server.Stop();
+    server_thread.join();
+}
+#endif
+
+TEST(RegexArray, SelectKeepsThePrefixRegex)
+{
+    RegexArray regex_array = LoadRegexes(
+        "prefix:/(?<time>\\d+) (?<details>.*)/\n"
+        "login:/user (?<user>\\w+) logged in/\n"
+        "logout:/user (?<user>\\w+) logged out/\n");
+    ASSERT_EQ(0, regex_array.prefix_regex_index());
+
+    regex_array.Select({ "logout", "missing" });
+    ASSERT_EQ(2, regex_array.size());
+    EXPECT_EQ("prefix", regex_array.get(0).id);
+    EXPECT_EQ("logout", regex_array.get(1).id);
+    EXPECT_EQ(0, regex_array.prefix_regex_index());
+}
+
+TEST(PCREDB, SelectFields)
+{
+    // The named group is the second one, so the output vector must be
+    // sized after the group number and not after the number of names
+    RegexArray regex_array;
+    regex_array.AddRegex("pair", "(\\w+)=(?<value>\\w+) (?<rest>.*)", 0);
+    regex_array.AddRegex("nofields", "(?<key>\\w+)=", 0);
+
+    PCREDB pcre_db;
+    pcre_db.select_fields({ "value" });
+    ASSERT_TRUE(pcre_db.BuildFrom(regex_array));
+
+    CaptureGroups capture_groups;
+    ASSERT_EQ(PCREMatchResult::OK, pcre_db.MatchRegex(0, "key=42 and more", capture_groups));
+    ASSERT_EQ(1u, capture_groups.size());
+    EXPECT_EQ("42", capture_groups["value"]);
+
+    // Without any selected group the match is still confirmed by PCRE
+    capture_groups.clear();
+    EXPECT_EQ(PCREMatchResult::OK, pcre_db.MatchRegex(1, "key=42", capture_groups));
+    EXPECT_TRUE(capture_groups.empty());
+    EXPECT_EQ(PCREMatchResult::NoMatch, pcre_db.MatchRegex(1, "no pair here", capture_groups));
+}
+
+TEST(Scanner, OnlyIdsAndFields)
+{
+    ScannerOptions options;
+    options.only_ids = { "login" };
+    options.select_fields = true;
+    options.fields = { "user" };
+
+    std::vector<MatchResults> matches;
+    Scanner scanner([&matches](const MatchResults& results) { matches.push_back(results); }, options);
+    std::istringstream patterns_stream(kPatterns);
+    ASSERT_TRUE(scanner.BuildFrom(patterns_stream));
+
+    std::istringstream input_stream(
+        "user alice logged in from example.org\n"
+        "user alice logged out\n");
+    ASSERT_TRUE(scanner.ScanStream(input_stream));
+
+    ASSERT_EQ(1u, matches.size());
+    EXPECT_EQ("login", matches[0].regex_id);
+    ASSERT_EQ(1u, matches[0].capture_groups.size());
+    EXPECT_EQ("alice", matches[0].capture_groups.at("user"));
+}
+
+TEST(Scanner, FieldsKeepDetailsOnlyForThePrefix)
+{
+    const char* const patterns =
+        "prefix:/^(?<host>\\w+): (?<details>.*)$/\n"
+        "note:/note (?<user>\\w+) (?<details>.*)/\n";
+    const std::string line = "web1: note alice was here\n";
+
+    for (const bool select_details : { false, true }) {
+        ScannerOptions options;
+        options.select_fields = true;
+        options.fields = { "user" };
+        if (select_details) {
+            options.fields.insert("details");
+        }
+
+        std::vector<MatchResults> matches;
+        Scanner scanner([&matches](const MatchResults& results) { matches.push_back(results); }, options);
+        std::istringstream patterns_stream(patterns);
+        ASSERT_TRUE(scanner.BuildFrom(patterns_stream));
+        std::istringstream input_stream(line);
+        ASSERT_TRUE(scanner.ScanStream(input_stream));
+
+        ASSERT_EQ(1u, matches.size());
+        EXPECT_EQ("note", matches[0].regex_id);
+        EXPECT_EQ("alice", matches[0].capture_groups.at("user"));
+        EXPECT_EQ(0u, matches[0].capture_groups.count("host"));
+        if (select_details) {
+            ASSERT_EQ(2u, matches[0].capture_groups.size());
+            EXPECT_EQ("was here", matches[0].capture_groups.at("details"));
+        } else {
+            EXPECT_EQ(1u, matches[0].capture_groups.size());
+        }
+    }
+}
+
+TEST(Scanner, OnlyUnknownIdsFails)
+{
+    ScannerOptions options;
+    options.only_ids = { "missing" };
+
+    Scanner scanner(ScannerMatchFn(), options);
+    std::istringstream patterns_stream(kPatterns);
+    EXPECT_FALSE(scanner.BuildFrom(patterns_stream));
+}
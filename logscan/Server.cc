@@ -0,0 +1,706 @@
+#include "Server.h"
+
+#include "Clock.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace logscan
+{
+    namespace
+    {
+        const size_t kReadChunkSize = 64 * 1024;
+        const int kMaxEvents = 64;
+
+        // Moves the complete lines of buffer to lines, leaving the incomplete last one
+        void SplitLines(string& buffer, deque<string>& lines)
+        {
+            size_t start = 0;
+            for (size_t end; (end = buffer.find('\n', start)) != string::npos; start = end + 1) {
+                string line(buffer, start, end - start);
+                StripLineEnding(line);
+                lines.emplace_back(std::move(line));
+            }
+            buffer.erase(0, start);
+        }
+
+        void PrintSystemError(const char* what)
+        {
+            cerr << "ERROR: " << what << ": " << strerror(errno) << endl;
+        }
+
+        // A server is listening on addr if we can connect to it
+        bool IsSocketInUse(const sockaddr_un& addr)
+        {
+            const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd == -1)
+                return false;
+            const bool in_use = connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0;
+            close(fd);
+            return in_use;
+        }
+    } // namespace
+
+    Server::Server(const Scanner& scanner, const ServerOptions& options)
+    : scanner_(scanner)
+    , options_(options)
+    , epoll_fd_(-1)
+    , wakeup_fd_(-1)
+    , signal_fd_(-1)
+    , unix_socket_bound_(false)
+    , connections_()
+    , accept_paused_(false)
+    , stop_requested_(false)
+    , workers_()
+    , queue_mutex_()
+    , queue_cv_()
+    , queue_()
+    , completed_()
+    , stopping_(false)
+    , sink_mutex_()
+    {
+        // Reading is paused on pending bytes, including the incomplete last
+        // line, so a longer line could never be completed
+        options_.max_line_bytes = min(options_.max_line_bytes, options_.max_pending_bytes);
+    }
+
+    Server::~Server()
+    {
+        for (auto& entry : connections_) {
+            close(entry.first);
+        }
+        connections_.clear();
+
+        // Only remove the socket we created, never someone else's file
+        if (unix_socket_bound_) {
+            unlink(options_.unix_socket_path.c_str());
+        }
+        if (epoll_fd_ != -1) {
+            close(epoll_fd_);
+        }
+        if (wakeup_fd_ != -1) {
+            close(wakeup_fd_);
+        }
+        if (signal_fd_ != -1) {
+            close(signal_fd_);
+        }
+    }
+
+    bool Server::Listen()
+    {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ == -1) {
+            PrintSystemError("epoll_create1");
+            return false;
+        }
+
+        // Workers write to this to make the event loop pick up their results
+        wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeup_fd_ == -1) {
+            PrintSystemError("eventfd");
+            return false;
+        }
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = wakeup_fd_;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &event) == -1) {
+            PrintSystemError("epoll_ctl");
+            return false;
+        }
+
+        if (!options_.unix_socket_path.empty()) {
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            if (options_.unix_socket_path.size() >= sizeof(addr.sun_path)) {
+                cerr << "Socket path is too long: " << options_.unix_socket_path << endl;
+                return false;
+            }
+            strcpy(addr.sun_path, options_.unix_socket_path.c_str());
+
+            const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd == -1) {
+                PrintSystemError("socket");
+                return false;
+            }
+            struct stat st;
+            if (lstat(addr.sun_path, &st) == 0) {
+                if (!S_ISSOCK(st.st_mode)) {
+                    cerr << "Not a socket, refusing to replace it: " << addr.sun_path << endl;
+                    close(fd);
+                    return false;
+                }
+                if (IsSocketInUse(addr)) {
+                    cerr << "Another server is listening on: " << addr.sun_path << endl;
+                    close(fd);
+                    return false;
+                }
+                // Remove the socket left behind by a previous run
+                unlink(addr.sun_path);
+            }
+            if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1) {
+                PrintSystemError(options_.unix_socket_path.c_str());
+                close(fd);
+                return false;
+            }
+            unix_socket_bound_ = true;
+            if (listen(fd, SOMAXCONN) == -1) {
+                PrintSystemError(options_.unix_socket_path.c_str());
+                close(fd);
+                return false;
+            }
+            if (!AddListener(fd, false, options_.sink))
+                return false;
+        }
+
+        if (options_.syslog_port != 0) {
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(options_.syslog_port);
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+            ostream* sink = options_.sink != nullptr ? options_.sink : &cout;
+            for (const int type : { SOCK_STREAM, SOCK_DGRAM }) {
+                const int fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+                if (fd == -1) {
+                    PrintSystemError("socket");
+                    return false;
+                }
+                const int reuse = 1;
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+                if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+                    (type == SOCK_STREAM && listen(fd, SOMAXCONN) == -1)) {
+                    PrintSystemError("syslog port");
+                    close(fd);
+                    return false;
+                }
+                if (!AddListener(fd, type == SOCK_DGRAM, sink))
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool Server::AddListener(int fd, bool is_datagram, ostream* sink)
+    {
+        auto listener = make_shared<Connection>();
+        listener->fd = fd;
+        // A datagram socket is read like a connection that never ends
+        listener->is_listener = !is_datagram;
+        listener->is_datagram = is_datagram;
+        listener->sink = sink;
+        return AddConnection(listener);
+    }
+
+    bool Server::AddConnection(const ConnectionPtr& connection)
+    {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = connection->fd;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, connection->fd, &event) == -1) {
+            PrintSystemError("epoll_ctl");
+            close(connection->fd);
+            return false;
+        }
+
+        connection->events = EPOLLIN;
+        connections_[connection->fd] = connection;
+        return true;
+    }
+
+    void Server::CloseConnection(const ConnectionPtr& connection)
+    {
+        if (connection->events != 0) {
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection->fd, nullptr);
+        }
+        connections_.erase(connection->fd);
+        close(connection->fd);
+
+        if (accept_paused_) {
+            ResumeAccepting();
+        }
+    }
+
+    void Server::PauseAccepting()
+    {
+        // The listeners stay readable, stop polling them until a connection
+        // is closed so that the event loop does not spin
+        cerr << "WARNING: Out of file descriptors, not accepting new clients for now" << endl;
+        for (auto& entry : connections_) {
+            Connection& listener = *entry.second;
+            if (listener.is_listener && listener.events != 0) {
+                epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, listener.fd, nullptr);
+                listener.events = 0;
+            }
+        }
+        accept_paused_ = true;
+    }
+
+    void Server::ResumeAccepting()
+    {
+        for (auto& entry : connections_) {
+            Connection& listener = *entry.second;
+            if (listener.is_listener && listener.events == 0) {
+                epoll_event event = {};
+                event.events = EPOLLIN;
+                event.data.fd = listener.fd;
+                if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listener.fd, &event) == -1) {
+                    PrintSystemError("epoll_ctl");
+                    continue;
+                }
+                listener.events = EPOLLIN;
+            }
+        }
+        accept_paused_ = false;
+    }
+
+    void Server::Stop()
+    {
+        stop_requested_ = true;
+        Wakeup();
+    }
+
+    bool Server::Run()
+    {
+        // Block the signals before starting the workers so that they inherit the mask
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        signal(SIGPIPE, SIG_IGN);
+
+        signal_fd_ = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (signal_fd_ == -1) {
+            PrintSystemError("signalfd");
+            return false;
+        }
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = signal_fd_;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, signal_fd_, &event) == -1) {
+            PrintSystemError("epoll_ctl");
+            return false;
+        }
+
+        int num_workers = options_.num_workers;
+        if (num_workers <= 0) {
+            num_workers = max(1u, thread::hardware_concurrency());
+        }
+
+        vector<HyperscanScratch> scratches;
+        for (int i = 0; i < num_workers; i++) {
+            HyperscanScratch scratch = scanner_.CloneScratch();
+            if (!scratch)
+                return false;
+            scratches.emplace_back(std::move(scratch));
+        }
+        for (auto& scratch : scratches) {
+            workers_.emplace_back(&Server::WorkerMain, this, scratch.get());
+        }
+
+        for (bool running = true; running; ) {
+            epoll_event events[kMaxEvents];
+            const int num_events = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+            if (num_events == -1) {
+                if (errno == EINTR)
+                    continue;
+                PrintSystemError("epoll_wait");
+                break;
+            }
+
+            for (int i = 0; i < num_events; i++) {
+                const int fd = events[i].data.fd;
+                if (fd == signal_fd_) {
+                    running = false;
+                    continue;
+                }
+                if (fd == wakeup_fd_) {
+                    uint64_t count;
+                    while (read(wakeup_fd_, &count, sizeof(count)) > 0) {
+                    }
+                    ProcessCompleted();
+                    if (stop_requested_) {
+                        running = false;
+                    }
+                    continue;
+                }
+
+                auto it = connections_.find(fd);
+                if (it == connections_.end())
+                    continue;
+                // Keep the connection alive even if it gets closed below
+                const ConnectionPtr connection = it->second;
+
+                if (connection->is_listener) {
+                    Accept(connection);
+                    continue;
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    if (connection->is_datagram) {
+                        ReadDatagrams(connection);
+                    } else {
+                        Read(connection);
+                    }
+                }
+                if (events[i].events & EPOLLOUT) {
+                    Write(connection);
+                }
+                Update(connection);
+            }
+        }
+
+        Shutdown();
+
+        return true;
+    }
+
+    void Server::Shutdown()
+    {
+        // The incomplete last lines are processed as if the clients had closed
+        for (auto& entry : connections_) {
+            const ConnectionPtr& connection = entry.second;
+            if (connection->is_listener || connection->is_datagram)
+                continue;
+            connection->eof = true;
+            if (!connection->read_buffer.empty()) {
+                deque<string> lines;
+                lines.emplace_back(std::move(connection->read_buffer));
+                connection->read_buffer.clear();
+                QueueLines(connection, std::move(lines));
+            }
+        }
+
+        // Let the workers finish the lines they already have
+        {
+            lock_guard<mutex> lock(queue_mutex_);
+            stopping_ = true;
+        }
+        queue_cv_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+        workers_.clear();
+        ProcessCompleted();
+
+        // Give the clients some time to read the rest of their results
+        Clock clock;
+        clock.start();
+        for (;;) {
+            vector<pollfd> poll_fds;
+            vector<ConnectionPtr> pending;
+            for (auto& entry : connections_) {
+                if (!entry.second->write_buffer.empty()) {
+                    poll_fds.push_back(pollfd { entry.first, POLLOUT, 0 });
+                    pending.push_back(entry.second);
+                }
+            }
+
+            clock.stop();
+            const int timeout_ms = options_.shutdown_timeout_ms - static_cast<int>(clock.seconds() * 1000);
+            if (pending.empty() || timeout_ms <= 0) {
+                size_t dropped_bytes = 0;
+                for (const auto& connection : pending) {
+                    dropped_bytes += connection->write_buffer.size();
+                }
+                if (!pending.empty()) {
+                    cerr << "WARNING: Dropped " << dropped_bytes << " bytes of results for "
+                         << pending.size() << " clients at shutdown" << endl;
+                }
+                return;
+            }
+
+            if (poll(poll_fds.data(), poll_fds.size(), timeout_ms) == -1 && errno != EINTR) {
+                PrintSystemError("poll");
+                return;
+            }
+            for (size_t i = 0; i < poll_fds.size(); i++) {
+                // Write() drops the results of the clients that are gone
+                if (poll_fds[i].revents != 0) {
+                    Write(pending[i]);
+                }
+            }
+        }
+    }
+
+    void Server::Accept(const ConnectionPtr& listener)
+    {
+        for (;;) {
+            const int fd = accept4(listener->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EMFILE || errno == ENFILE) {
+                    PauseAccepting();
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    PrintSystemError("accept");
+                }
+                return;
+            }
+
+            auto connection = make_shared<Connection>();
+            connection->fd = fd;
+            connection->sink = listener->sink;
+            AddConnection(connection);
+        }
+    }
+
+    void Server::Read(const ConnectionPtr& connection)
+    {
+        // One chunk per event: the socket stays readable, and checking the
+        // limit between chunks is what keeps a fast client in check
+        char buffer[kReadChunkSize];
+        const ssize_t n = read(connection->fd, buffer, sizeof(buffer));
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+
+        deque<string> lines;
+        if (n > 0) {
+            connection->read_buffer.append(buffer, n);
+            SplitLines(connection->read_buffer, lines);
+            if (connection->read_buffer.size() > options_.max_line_bytes) {
+                cerr << "ERROR: Line longer than " << options_.max_line_bytes
+                     << " bytes, closing the connection" << endl;
+                connection->read_buffer.clear();
+                connection->eof = true;
+            }
+        } else {
+            if (n < 0) {
+                PrintSystemError("read");
+            }
+            connection->eof = true;
+            if (!connection->read_buffer.empty()) {
+                lines.emplace_back(std::move(connection->read_buffer));
+                connection->read_buffer.clear();
+            }
+        }
+
+        QueueLines(connection, std::move(lines));
+    }
+
+    void Server::ReadDatagrams(const ConnectionPtr& connection)
+    {
+        char buffer[kReadChunkSize];
+        const ssize_t n = recv(connection->fd, buffer, sizeof(buffer), 0);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                PrintSystemError("recv");
+            }
+            return;
+        }
+
+        // Each datagram holds complete messages
+        string data(buffer, n);
+        if (data.empty() || data.back() != '\n') {
+            data.push_back('\n');
+        }
+        deque<string> lines;
+        SplitLines(data, lines);
+
+        QueueLines(connection, std::move(lines));
+    }
+
+    void Server::Write(const ConnectionPtr& connection)
+    {
+        string& buffer = connection->write_buffer;
+        size_t written = 0;
+        while (written < buffer.size()) {
+            const ssize_t n = send(connection->fd, buffer.data() + written, buffer.size() - written, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                // The client is gone: drop its results and stop reading from it
+                written = buffer.size();
+                connection->eof = true;
+                break;
+            }
+            written += n;
+        }
+        buffer.erase(0, written);
+    }
+
+    void Server::QueueLines(const ConnectionPtr& connection, deque<string> lines)
+    {
+        if (lines.empty())
+            return;
+
+        {
+            lock_guard<mutex> lock(connection->mutex);
+            for (auto& line : lines) {
+                connection->pending_bytes += line.size();
+                connection->lines.emplace_back(std::move(line));
+            }
+        }
+
+        Schedule(connection);
+    }
+
+    void Server::Schedule(const ConnectionPtr& connection)
+    {
+        {
+            lock_guard<mutex> lock(connection->mutex);
+            if (connection->scheduled)
+                return;
+            connection->scheduled = true;
+        }
+
+        {
+            lock_guard<mutex> lock(queue_mutex_);
+            queue_.push_back(connection);
+        }
+        queue_cv_.notify_one();
+    }
+
+    void Server::Update(const ConnectionPtr& connection)
+    {
+        size_t pending_bytes;
+        bool busy;
+        {
+            lock_guard<mutex> lock(connection->mutex);
+            pending_bytes = connection->pending_bytes + connection->output.size();
+            busy = connection->scheduled || !connection->output.empty();
+        }
+        pending_bytes += connection->write_buffer.size() + connection->read_buffer.size();
+
+        if (connection->eof && !busy && connection->write_buffer.empty()) {
+            CloseConnection(connection);
+            return;
+        }
+
+        unsigned int events = 0;
+        if (!connection->eof && pending_bytes <= options_.max_pending_bytes) {
+            events |= EPOLLIN;
+        }
+        if (!connection->write_buffer.empty()) {
+            events |= EPOLLOUT;
+        }
+        if (events == connection->events)
+            return;
+
+        // Unregister instead of waiting for no events, as EPOLLHUP would still be reported
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = connection->fd;
+        if (events == 0) {
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection->fd, nullptr);
+        } else {
+            epoll_ctl(epoll_fd_, connection->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, connection->fd, &event);
+        }
+        connection->events = events;
+    }
+
+    void Server::ProcessCompleted()
+    {
+        vector<ConnectionPtr> completed;
+        {
+            lock_guard<mutex> lock(queue_mutex_);
+            completed.swap(completed_);
+        }
+
+        for (const auto& connection : completed) {
+            auto it = connections_.find(connection->fd);
+            if (it == connections_.end() || it->second != connection)
+                continue;
+
+            {
+                lock_guard<mutex> lock(connection->mutex);
+                connection->write_buffer += connection->output;
+                connection->output.clear();
+            }
+            Write(connection);
+            Update(connection);
+        }
+    }
+
+    void Server::WorkerMain(hs_scratch_t* scratch)
+    {
+        for (;;) {
+            ConnectionPtr connection;
+            {
+                unique_lock<mutex> lock(queue_mutex_);
+                queue_cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+                if (queue_.empty())
+                    return;
+                connection = std::move(queue_.front());
+                queue_.pop_front();
+            }
+
+            deque<string> lines;
+            {
+                lock_guard<mutex> lock(connection->mutex);
+                lines.swap(connection->lines);
+            }
+
+            ostringstream output;
+            size_t processed_bytes = 0;
+            for (const string& line : lines) {
+                processed_bytes += line.size();
+                MatchResults results;
+                if (scanner_.ProcessLine(line, results, scratch)) {
+                    PrintJSONMatchFn(results, output);
+                }
+            }
+
+            if (connection->sink != nullptr) {
+                lock_guard<mutex> lock(sink_mutex_);
+                *connection->sink << output.str() << flush;
+            }
+
+            bool more;
+            {
+                lock_guard<mutex> lock(connection->mutex);
+                connection->pending_bytes -= processed_bytes;
+                if (connection->sink == nullptr) {
+                    connection->output += output.str();
+                }
+                // Lines that arrived meanwhile go back to the queue, but the
+                // connection stays scheduled so no other worker can take it
+                // before the results above are handed over
+                more = !connection->lines.empty();
+                connection->scheduled = more;
+            }
+
+            {
+                lock_guard<mutex> lock(queue_mutex_);
+                if (more) {
+                    queue_.push_back(connection);
+                }
+                completed_.push_back(connection);
+            }
+            if (more) {
+                queue_cv_.notify_one();
+            }
+
+            Wakeup();
+        }
+    }
+
+    void Server::Wakeup()
+    {
+        const uint64_t one = 1;
+        if (write(wakeup_fd_, &one, sizeof(one)) == -1) {
+            // The counter can only overflow if the event loop is gone
+        }
+    }
+
+} // namespace logscan
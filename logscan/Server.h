@@ -0,0 +1,130 @@
+#ifndef LOGSCAN_SERVER_H_
+#define LOGSCAN_SERVER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Scanner.h"
+
+namespace logscan
+{
+    struct ServerOptions
+    {
+        // Stream socket, the results are sent back on each connection
+        std::string unix_socket_path;
+
+        // Syslog over TCP and UDP on 127.0.0.1, 0 disables it. Syslog senders
+        // do not read, so the results always go to the sink (stdout by default).
+        int syslog_port = 0;
+
+        int num_workers = 0;    // 0 means one per core
+
+        // Reading from a client is paused while this many bytes of its lines
+        // and results are waiting to be processed or sent
+        size_t max_pending_bytes = 1 << 20;
+
+        // Clients sending a longer line are disconnected. Capped to
+        // max_pending_bytes.
+        size_t max_line_bytes = 256 * 1024;
+
+        // How long to wait at shutdown for the clients to read their results
+        int shutdown_timeout_ms = 5000;
+
+        // If set, the results of every client are written here instead
+        std::ostream* sink = nullptr;
+    };
+
+    // Serves many log streams with a single Scanner. An epoll event loop does
+    // all the socket I/O and hands the lines to a fixed pool of workers, each
+    // with its own Hyperscan scratch space. The lines of a client are
+    // processed by one worker at a time, so its results keep their order.
+    class Server
+    {
+    public:
+        Server(const Scanner& scanner, const ServerOptions& options);
+        ~Server();
+
+        Server(const Server&) = delete;
+        Server& operator=(const Server&) = delete;
+
+        bool Listen();
+
+        // Serves the clients until SIGINT, SIGTERM or Stop()
+        bool Run();
+
+        // Makes Run() return, can be called from any thread
+        void Stop();
+
+    private:
+        struct Connection
+        {
+            int fd = -1;
+            bool is_listener = false;
+            bool is_datagram = false;
+            std::ostream* sink = nullptr;   // nullptr means reply on fd
+
+            // Only used by the event loop
+            std::string read_buffer;        // incomplete last line
+            std::string write_buffer;       // results not yet sent
+            bool eof = false;
+            unsigned int events = 0;
+
+            // Shared with the workers
+            std::mutex mutex;
+            std::deque<std::string> lines;
+            std::string output;
+            size_t pending_bytes = 0;       // size of lines
+            bool scheduled = false;         // queued or owned by a worker
+        };
+        using ConnectionPtr = std::shared_ptr<Connection>;
+
+        bool AddListener(int fd, bool is_datagram, std::ostream* sink);
+        bool AddConnection(const ConnectionPtr& connection);
+        void CloseConnection(const ConnectionPtr& connection);
+
+        void Accept(const ConnectionPtr& listener);
+        void Read(const ConnectionPtr& connection);
+        void ReadDatagrams(const ConnectionPtr& connection);
+        void Write(const ConnectionPtr& connection);
+        void QueueLines(const ConnectionPtr& connection, std::deque<std::string> lines);
+        void Update(const ConnectionPtr& connection);
+        void ProcessCompleted();
+        void PauseAccepting();
+        void ResumeAccepting();
+        void Shutdown();
+
+        void WorkerMain(hs_scratch_t* scratch);
+        void Schedule(const ConnectionPtr& connection);
+        void Wakeup();
+
+        const Scanner& scanner_;
+        ServerOptions options_;
+
+        int epoll_fd_;
+        int wakeup_fd_;
+        int signal_fd_;
+        bool unix_socket_bound_;
+        std::unordered_map<int, ConnectionPtr> connections_;
+        bool accept_paused_;
+        std::atomic<bool> stop_requested_;
+
+        std::vector<std::thread> workers_;
+        std::mutex queue_mutex_;
+        std::condition_variable queue_cv_;
+        std::deque<ConnectionPtr> queue_;
+        std::vector<ConnectionPtr> completed_;
+        bool stopping_;
+
+        std::mutex sink_mutex_;
+    };
+} // namespace logscan
+
+#endif  // LOGSCAN_SERVER_H_
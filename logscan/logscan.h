@@ -4,7 +4,11 @@
 #include "Clock.h"
 #include "HyperscanDB.h"
 #include "PCREDB.h"
+#include "PatternProfiler.h"
 #include "RegexArray.h"
 #include "Scanner.h"
+#ifdef __linux__
+#include "Server.h"
+#endif
 
 #endif  // LOGSCAN_LOGSCAN_H_
@@ -1,7 +1,13 @@
 
+#include <cerrno>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
-#include <unistd.h> // getopt
+#include <functional>
+#include <getopt.h> // getopt_long
+#include <sstream>
+#include <string>
+#include <unordered_set>
 
 #include "logscan/logscan.h"
 
@@ -9,17 +15,150 @@ using namespace std;
 using namespace logscan;
 
 static void Usage(const char* prog) {
-    cerr << "Usage: " << prog << " -p <pattern file> [-o <output file>] [-s] [<input file>...]" << endl;
+    cerr << "Usage: " << prog << " -p <pattern file> [-o <output file>] [-s] [-j <threads>] [--only <ids>] [--fields <names>] [<input file>...]" << endl;
+    cerr << "       " << prog << " -p <pattern file> [-o <output file>] [--only <ids>] --profile-patterns [<input file>...]" << endl;
+#ifdef __linux__
+    cerr << "       " << prog << " -p <pattern file> [-o <output file>] [-j <threads>] [--only <ids>] [--fields <names>] [-d <socket path>] [--syslog-port <port>] [--workers <n>]" << endl;
+#endif
+    cerr << "  -j <threads>  compile all PCRE patterns up front on <threads> threads (0: one per core)" << endl;
+    cerr << "                instead of compiling each one the first time it matches" << endl;
+    cerr << "  --only <ids>  comma separated list of the regex ids to match, the others are not compiled," << endl;
+    cerr << "                so a line matching several regexes is reported under the last selected one" << endl;
+    cerr << "  --fields <names>" << endl;
+    cerr << "                comma separated list of the named groups to extract and print" << endl;
+    cerr << "  --profile-patterns" << endl;
+    cerr << "                measure the cost of each pattern on the input and print a ranked report" << endl;
+    cerr << "                instead of the matches" << endl;
+#ifdef __linux__
+    cerr << "  -d, --daemon <socket path>" << endl;
+    cerr << "                serve log streams on a Unix domain socket, the results are sent back" << endl;
+    cerr << "                on each connection unless -o is given" << endl;
+    cerr << "  --syslog-port <port>" << endl;
+    cerr << "                serve syslog over TCP and UDP on 127.0.0.1, the results are written" << endl;
+    cerr << "                to the output file or stdout" << endl;
+    cerr << "  --workers <n> number of threads matching the lines in daemon mode (default: one per core)" << endl;
+#endif
+}
+
+// Parses a whole decimal number in [min_value, max_value]
+static bool ParseInt(const char* text, int min_value, int max_value, int& value) {
+    char* end = nullptr;
+    errno = 0;
+    const long parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || parsed < min_value || parsed > max_value)
+        return false;
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+static unordered_set<string> SplitList(const char* list) {
+    unordered_set<string> items;
+    istringstream list_stream(list);
+    for (string item; getline(list_stream, item, ','); ) {
+        if (!item.empty()) {
+            items.insert(item);
+        }
+    }
+    return items;
+}
+
+// Calls scan_fn on each input file, or on stdin if there are none
+static bool ScanInputs(int first, int argc, char** argv, const function<bool (istream&)>& scan_fn) {
+    if (first == argc) {
+        // No input files were specified - use stdin
+        return scan_fn(cin);
+    }
+
+    // Input files were specified - open and parse them one by one
+    for (int i = first; i < argc; i++) {
+        const char* input_file = argv[i];
+        ifstream input_stream(input_file);
+        if (!input_stream.good()) {
+            cerr << "Cannot open input file: " << input_file << endl;
+            return false;
+        }
+        if (!scan_fn(input_stream))
+            return false;
+    }
+
+    return true;
+}
+
+#ifdef __linux__
+static int ServeStreams(const char* patterns_file, const ScannerOptions& options,
+                        const ServerOptions& server_options) {
+    Scanner scanner(ScannerMatchFn(), options);
+    if (!scanner.BuildFrom(patterns_file))
+        return -1;
+
+    Server server(scanner, server_options);
+    if (!server.Listen())
+        return -1;
+
+    if (!server.Run())
+        return -1;
+
+    return 0;
+}
+#endif
+
+static int ProfilePatterns(const char* patterns_file, const unordered_set<string>& only_ids,
+                           int first, int argc, char** argv, ostream& output_stream) {
+    PatternProfiler profiler;
+    profiler.select_ids(only_ids);
+    if (!profiler.BuildFrom(patterns_file))
+        return -1;
+
+    auto sample_fn = [&profiler](istream& input_stream) {
+        profiler.AddSample(input_stream);
+        return true;
+    };
+    if (!ScanInputs(first, argc, argv, sample_fn))
+        return -1;
+
+    if (!profiler.Run())
+        return -1;
+
+    profiler.PrintReport(output_stream);
+    return 0;
 }
 
 int main(int argc, char** argv) {
     const char* patterns_file = nullptr;
     const char* output_file = nullptr;
-    bool perf_stats = false;
+    ScannerOptions options;
+    bool profile_patterns = false;
+#ifdef __linux__
+    ServerOptions server_options;
+#endif
+
+    enum LongOnlyOptions {
+        OPT_PROFILE_PATTERNS = 256,
+        OPT_SYSLOG_PORT,
+        OPT_WORKERS,
+        OPT_ONLY,
+        OPT_FIELDS,
+    };
+    const struct option long_options[] = {
+        { "profile-patterns", no_argument, nullptr, OPT_PROFILE_PATTERNS },
+#ifdef __linux__
+        { "daemon", required_argument, nullptr, 'd' },
+        { "syslog-port", required_argument, nullptr, OPT_SYSLOG_PORT },
+        { "workers", required_argument, nullptr, OPT_WORKERS },
+#endif
+        { "only", required_argument, nullptr, OPT_ONLY },
+        { "fields", required_argument, nullptr, OPT_FIELDS },
+        { nullptr, 0, nullptr, 0 },
+    };
 
     // Process command line arguments
     int opt;
-    while ((opt = getopt(argc, argv, "p:o:s")) != -1) {
+#ifdef __linux__
+    const char* short_options = "p:o:sj:d:";
+#else
+    const char* short_options = "p:o:sj:";
+#endif
+    while ((opt = getopt_long(argc, argv, short_options, long_options, nullptr)) != -1) {
         switch (opt) {
         case 'p':
             patterns_file = optarg;
@@ -28,7 +167,41 @@ int main(int argc, char** argv) {
             output_file = optarg;
             break;
         case 's':
-            perf_stats = true;
+            options.perf_stats = true;
+            break;
+        case 'j':
+            options.pcre_compile_mode = PCRECompileMode::Parallel;
+            if (!ParseInt(optarg, 0, 1024, options.pcre_compile_threads)) {
+                Usage(argv[0]);
+                return -1;
+            }
+            break;
+        case OPT_PROFILE_PATTERNS:
+            profile_patterns = true;
+            break;
+#ifdef __linux__
+        case 'd':
+            server_options.unix_socket_path = optarg;
+            break;
+        case OPT_SYSLOG_PORT:
+            if (!ParseInt(optarg, 1, 65535, server_options.syslog_port)) {
+                Usage(argv[0]);
+                return -1;
+            }
+            break;
+        case OPT_WORKERS:
+            if (!ParseInt(optarg, 0, 1024, server_options.num_workers)) {
+                Usage(argv[0]);
+                return -1;
+            }
+            break;
+#endif
+        case OPT_ONLY:
+            options.only_ids = SplitList(optarg);
+            break;
+        case OPT_FIELDS:
+            options.select_fields = true;
+            options.fields = SplitList(optarg);
             break;
         default:
             Usage(argv[0]);
@@ -36,7 +209,20 @@ int main(int argc, char** argv) {
         }
     }
 
-    if (patterns_file == nullptr) {
+#ifdef __linux__
+    const bool daemon = !server_options.unix_socket_path.empty() || server_options.syslog_port != 0;
+#else
+    const bool daemon = false;
+#endif
+    if (patterns_file == nullptr || (daemon && (profile_patterns || optind != argc))) {
+        Usage(argv[0]);
+        return -1;
+    }
+
+    // The profiler compiles every pattern and extracts every group
+    const bool profile_only_options = !options.perf_stats
+        && options.pcre_compile_mode == PCRECompileMode::Lazy && !options.select_fields;
+    if (profile_patterns && !profile_only_options) {
         Usage(argv[0]);
         return -1;
     }
@@ -54,31 +240,29 @@ int main(int argc, char** argv) {
         p_output_stream = &cout;
     }
 
+#ifdef __linux__
+    if (daemon) {
+        server_options.sink = output_file != nullptr ? p_output_stream : nullptr;
+        return ServeStreams(patterns_file, options, server_options);
+    }
+#endif
+
+    if (profile_patterns) {
+        return ProfilePatterns(patterns_file, options.only_ids, optind, argc, argv, *p_output_stream);
+    }
+
     auto match_fn = [p_output_stream](const MatchResults& match_results) {
         PrintJSONMatchFn(match_results, *p_output_stream);
     };
-    Scanner scanner(match_fn, perf_stats);
+    Scanner scanner(match_fn, options);
     if (!scanner.BuildFrom(patterns_file))
         return -1;
 
-    if (optind == argc) {
-        // No input files were specified - use stdin
-        if (!scanner.ScanStream(cin))
-            return -1;
-
-    } else {
-        // Input files were specified - open and parse them one by one
-        for (int i = optind; i < argc; i++) {
-            const char* input_file = argv[i];
-            ifstream input_stream(input_file);
-            if (!input_stream.good()) {
-                cerr << "Cannot open input file: " << input_file << endl;
-                return -1;
-            }
-            if (!scanner.ScanStream(input_stream))
-                return -1;
-        }
-    }
+    auto scan_fn = [&scanner](istream& input_stream) {
+        return scanner.ScanStream(input_stream);
+    };
+    if (!ScanInputs(optind, argc, argv, scan_fn))
+        return -1;
 
     return 0;
 }